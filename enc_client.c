@@ -8,6 +8,8 @@
 #include <netdb.h>
 
 #define MAX_BUFFER 1000
+#define MAX_MESSAGE_LENGTH (64 * 1024 * 1024) // Longest text the servers accept
+#define BINARY_MODE 'b'
 
 void report_error(const char *msg, ...)
 {
@@ -44,44 +46,42 @@ void initializeSocketAddress(struct sockaddr_in *addr, int port, char *host)
     freeaddrinfo(result);
 }
 
-void transmitData(int socket_fd, const char *data)
+void transmitData(int socket_fd, const char *data, int length)
 {
-    int length = strlen(data);
-    if (send(socket_fd, &length, sizeof(length), 0) < 0)
+    if (send(socket_fd, &length, sizeof(length), MSG_NOSIGNAL) < 0)
         report_error("Failed to send data length");
-    if (send(socket_fd, data, length, 0) < 0)
+    if (send(socket_fd, data, length, MSG_NOSIGNAL) < 0)
         report_error("Failed to send data");
 }
 
-char *receiveData(int socket_fd)
+int receiveData(int socket_fd, char *buffer, int capacity)
 {
     int data_length;
-    if (recv(socket_fd, &data_length, sizeof(data_length), 0) < 0)
+    if (recv(socket_fd, &data_length, sizeof(data_length), MSG_WAITALL) != sizeof(data_length))
         report_error("Failed to receive data length");
-
-    char *buffer = malloc(data_length + 1);
-    if (!buffer)
-        report_error("Memory allocation failed");
+    if (data_length < 0 || data_length > capacity)
+        report_error("Server sent an unexpected data length");
 
     int received = 0, bytes;
     while (received < data_length)
     {
         int to_read = data_length - received > MAX_BUFFER ? MAX_BUFFER : data_length - received;
         bytes = recv(socket_fd, buffer + received, to_read, 0);
-        if (bytes < 0)
+        if (bytes <= 0)
             report_error("Failed to receive data");
         received += bytes;
     }
 
     buffer[data_length] = '\0';
-    return buffer;
+    return data_length;
 }
 
-void performValidation(int sock_fd)
+void performValidation(int sock_fd, int binary)
 {
     char msgFromClient[4] = "enc", msgFromServer[4] = {0};
+    msgFromClient[3] = binary ? BINARY_MODE : '\0'; // The fourth byte asks for a mode
 
-    if (send(sock_fd, msgFromClient, sizeof(msgFromClient), 0) < 0)
+    if (send(sock_fd, msgFromClient, sizeof(msgFromClient), MSG_NOSIGNAL) < 0)
         report_error("Error sending validation message");
 
     int receivedBytes = 0;
@@ -95,7 +95,8 @@ void performValidation(int sock_fd)
         receivedBytes += bytes;
     }
 
-    if (strncmp(msgFromClient, msgFromServer, sizeof(msgFromClient)) != 0)
+    // The server echoes the mode only if it accepted it, so compare all four bytes
+    if (memcmp(msgFromClient, msgFromServer, sizeof(msgFromClient)) != 0)
     {
         close(sock_fd);
         report_error("Validation with server failed");
@@ -136,16 +137,65 @@ char *readStringFromFile(char *filePath)
     return fileContent;
 }
 
+char *readBytesFromFile(char *filePath, int *length)
+{
+    // Binary payloads are taken byte for byte, with no newline to strip
+    FILE *filePtr = fopen(filePath, "rb");
+    if (!filePtr)
+        report_error("Failed to open file: %s", filePath);
+
+    fseek(filePtr, 0, SEEK_END);
+    long fileLen = ftell(filePtr);
+    fseek(filePtr, 0, SEEK_SET);
+    if (fileLen < 0 || fileLen > 0x7fffffff)
+        report_error("File is too large: %s", filePath);
+
+    char *fileContent = (char *)malloc(fileLen + 1);
+    if (!fileContent)
+    {
+        fclose(filePtr);
+        report_error("Memory allocation failed for file content");
+    }
+    if (fread(fileContent, 1, fileLen, filePtr) != (size_t)fileLen)
+        report_error("Failed to read file: %s", filePath);
+
+    fclose(filePtr);
+    *length = (int)fileLen;
+    return fileContent;
+}
+
 int main(int argc, char *argv[])
 {
+    // An optional leading -b switches to binary mode: raw bytes XORed with a raw key
+    int binary = argc > 1 && strcmp(argv[1], "-b") == 0;
+    if (binary)
+    {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
     if (argc < 4)
-        report_error("Usage: %s <text file> <key file> <port>", argv[0]);
+        report_error("Usage: %s [-b] <text file> <key file> <port>", argv[0]);
 
-    char *text = readStringFromFile(argv[1]);
-    char *key = readStringFromFile(argv[2]);
+    char *text, *key;
+    int textLen, keyLen;
+    if (binary)
+    {
+        text = readBytesFromFile(argv[1], &textLen);
+        key = readBytesFromFile(argv[2], &keyLen);
+    }
+    else
+    {
+        text = readStringFromFile(argv[1]);
+        key = readStringFromFile(argv[2]);
+        textLen = strlen(text);
+        keyLen = strlen(key);
+    }
 
-    if (strlen(text) > strlen(key))
+    if (textLen > keyLen)
         report_error("The key is shorter than the text");
+    if (textLen > MAX_MESSAGE_LENGTH)
+        report_error("The text is longer than the %d byte limit", MAX_MESSAGE_LENGTH);
 
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0)
@@ -157,13 +207,15 @@ int main(int argc, char *argv[])
     if (connect(sock, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
         report_error("Failed to connect to the server");
 
-    performValidation(sock);
-    transmitData(sock, text);
-    transmitData(sock, key);
-    char *received = receiveData(sock);
-    printf("%s\n", received);
+    performValidation(sock, binary);
+    transmitData(sock, text, textLen);
+    transmitData(sock, key, textLen); // The server only needs as much key as there is text
+    receiveData(sock, text, textLen); // The ciphertext overwrites the plaintext buffer
+    if (binary)
+        fwrite(text, 1, textLen, stdout);
+    else
+        printf("%s\n", text);
 
-    free(received); // Free the received data after printing
     close(sock);
     return 0;
 }
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,8 +6,34 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #define MAX_BUFFER 1000
+#define WORKER_COUNT 5
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAX_MESSAGE_LENGTH (64 * 1024 * 1024) // Longest text or key a worker accepts
+#define CLIENT_TIMEOUT_SEC 2 // How long a silent client may hold a worker
+#define ACCEPT_BACKOFF_USEC 100000
+#define BINARY_MODE 'b'
+
+// A reusable region of memory owned by one worker. Slabs only ever grow, so
+// once a worker has served a request of a given size it can serve any smaller
+// one again without touching the heap or faulting in fresh pages. The message
+// length cap bounds how far they can grow.
+struct slab
+{
+    char *base;
+    size_t size;
+};
+
+// Each worker keeps one slab for the text (which is also where the result is
+// written) and one for the key; both survive across requests.
+static struct slab text_slab, key_slab;
+
+// Binary payloads are XORed a whole vector at a time
+typedef unsigned char xor_block __attribute__((vector_size(32)));
 
 int handle_error(int statusCode, const char *msg, ...)
 {
@@ -19,6 +46,54 @@ int handle_error(int statusCode, const char *msg, ...)
     exit(statusCode);
 }
 
+void report_error(const char *msg, ...)
+{
+    // Same format as handle_error, for errors a worker survives
+    va_list argp;
+    va_start(argp, msg);
+    fprintf(stderr, "Error detected: ");
+    vfprintf(stderr, msg, argp);
+    fprintf(stderr, "\n");
+    va_end(argp);
+}
+
+char *reserve_slab(struct slab *slab, size_t needed)
+{
+    if (needed <= slab->size)
+        return slab->base;
+
+    // Round up to whole pages, or to whole huge pages for large payloads
+    size_t granule = needed >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (needed + granule - 1) / granule * granule;
+
+    if (slab->base)
+        munmap(slab->base, slab->size);
+    slab->base = NULL;
+    slab->size = 0;
+
+    void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit huge pages only work if the admin reserved some, so fall back quietly
+    if (granule == HUGE_PAGE_SIZE)
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        // Let transparent huge pages back the slab when available
+        if (granule == HUGE_PAGE_SIZE)
+            madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    slab->base = memory;
+    slab->size = size;
+    return slab->base;
+}
+
 void init_sockaddr(struct sockaddr_in *addr, int port)
 {
     memset((char *)addr, 0, sizeof(*addr));
@@ -27,110 +102,212 @@ void init_sockaddr(struct sockaddr_in *addr, int port)
     addr->sin_addr.s_addr = INADDR_ANY;
 }
 
-void send_message(int connection, char *message)
+int send_message(int connection, const char *message, int message_len)
 {
-    int message_len = strlen(message), sent_bytes = 0;
-    if (send(connection, &message_len, sizeof(message_len), 0) < 0)
-        handle_error(1, "Error sending on socket");
+    int sent_bytes = 0;
+    if (send(connection, &message_len, sizeof(message_len), MSG_NOSIGNAL) < 0)
+        return -1;
 
     while (sent_bytes < message_len)
     {
         int bytes_to_send = message_len - sent_bytes > MAX_BUFFER ? MAX_BUFFER : message_len - sent_bytes;
-        int sent = send(connection, message + sent_bytes, bytes_to_send, 0);
+        int sent = send(connection, message + sent_bytes, bytes_to_send, MSG_NOSIGNAL);
         if (sent < 0)
-            handle_error(1, "Error sending on socket");
+            return -1;
         sent_bytes += sent;
     }
+    return 0;
 }
 
-char *receive_message(int connection)
+char *receive_message(int connection, struct slab *slab, int *message_len)
 {
-    int message_len;
-    if (recv(connection, &message_len, sizeof(message_len), 0) < 0)
-        handle_error(1, "Error reading from socket");
+    if (recv(connection, message_len, sizeof(*message_len), MSG_WAITALL) != sizeof(*message_len) || *message_len < 0)
+        return NULL;
+    if (*message_len > MAX_MESSAGE_LENGTH)
+    {
+        report_error("Message of %d bytes exceeds the limit", *message_len);
+        return NULL;
+    }
 
-    char *buffer = malloc(message_len + 1);
+    // Received straight into the worker's slab instead of a fresh allocation
+    char *buffer = reserve_slab(slab, (size_t)*message_len + 1);
     if (!buffer)
-        handle_error(1, "Memory allocation failed");
+        return NULL;
 
     int received = 0;
-    while (received < message_len)
+    while (received < *message_len)
     {
-        int bytes = recv(connection, buffer + received, message_len - received, 0);
-        if (bytes < 0)
-        {
-            free(buffer);
-            handle_error(1, "Error reading from socket");
-        }
+        int bytes = recv(connection, buffer + received, *message_len - received, 0);
+        if (bytes <= 0)
+            return NULL;
         received += bytes;
     }
-    buffer[message_len] = '\0';
+    buffer[*message_len] = '\0';
     return buffer;
 }
 
-void authenticate_client(int connection)
+// Returns -1 if the client is rejected, otherwise whether it asked for binary mode
+int authenticate_client(int connection)
 {
     char server_signal[4] = "enc", client_signal[4] = {0};
-    if (send(connection, server_signal, sizeof(server_signal), 0) < 0)
-        handle_error(1, "Error sending on socket");
 
     int received_bytes = 0;
     while (received_bytes < sizeof(client_signal))
     {
         int bytes = recv(connection, client_signal + received_bytes, sizeof(client_signal) - received_bytes, 0);
-        if (bytes < 0)
-            handle_error(1, "Error reading from socket");
+        if (bytes <= 0)
+            return -1;
         received_bytes += bytes;
     }
 
-    if (strncmp(server_signal, client_signal, sizeof(server_signal)) != 0)
+    // The first three bytes name the program, the fourth asks for a mode. The
+    // reply echoes the mode only if it is accepted, so the client can tell.
+    int accepted = strncmp(server_signal, client_signal, 3) == 0 &&
+                   (client_signal[3] == '\0' || client_signal[3] == BINARY_MODE);
+    if (accepted)
+        server_signal[3] = client_signal[3];
+    if (send(connection, server_signal, sizeof(server_signal), MSG_NOSIGNAL) < 0)
+        return -1;
+
+    if (!accepted)
     {
-        close(connection);
-        handle_error(2, "Authentication failed");
+        report_error(strncmp(server_signal, client_signal, 3) != 0 ? "Authentication failed" : "Client asked for an unknown mode");
+        return -1;
     }
+    return client_signal[3] == BINARY_MODE;
 }
 
-void process_encryption(int connection)
+void xor_in_place(char *text, const char *key, int length)
 {
-    char *text = receive_message(connection);
-    char *key = receive_message(connection);
-    int text_length = strlen(text);
+    int i = 0;
+    // memcpy keeps the vector loads and stores legal at any alignment
+    for (; i + (int)sizeof(xor_block) <= length; i += sizeof(xor_block))
+    {
+        xor_block text_block, key_block;
+        memcpy(&text_block, text + i, sizeof(text_block));
+        memcpy(&key_block, key + i, sizeof(key_block));
+        text_block ^= key_block;
+        memcpy(text + i, &text_block, sizeof(text_block));
+    }
+    for (; i < length; ++i)
+        text[i] ^= key[i];
+}
 
-    char *encrypted_text = malloc(text_length + 1);
-    if (!encrypted_text)
+void process_encryption(int connection, int binary)
+{
+    int text_length, key_length;
+    char *text = receive_message(connection, &text_slab, &text_length);
+    if (!text)
     {
-        free(text);
-        free(key);
-        close(connection);
+        report_error("Error reading plaintext from socket");
+        return;
+    }
+    char *key = receive_message(connection, &key_slab, &key_length);
+    if (!key)
+    {
+        report_error("Error reading key from socket");
+        return;
+    }
+    if (key_length < text_length)
+    {
+        report_error("Key is shorter than the plaintext");
         return;
     }
 
-    for (int i = 0; i < text_length; ++i)
+    // Encrypt in place: the plaintext buffer becomes the ciphertext. XOR is its own
+    // inverse, so binary mode is the same in both servers.
+    if (binary)
+        xor_in_place(text, key, text_length);
+    else
     {
-        int text_char = (text[i] == ' ') ? 26 : text[i] - 'A';
-        int key_char = (key[i] == ' ') ? 26 : key[i] - 'A';
-        int encrypted_char = (text_char + key_char) % 27;
-        encrypted_text[i] = (encrypted_char == 26) ? ' ' : encrypted_char + 'A';
+        for (int i = 0; i < text_length; ++i)
+        {
+            int text_char = (text[i] == ' ') ? 26 : text[i] - 'A';
+            int key_char = (key[i] == ' ') ? 26 : key[i] - 'A';
+            int encrypted_char = (text_char + key_char) % 27;
+            text[i] = (encrypted_char == 26) ? ' ' : encrypted_char + 'A';
+        }
     }
-    encrypted_text[text_length] = '\0';
 
-    send_message(connection, encrypted_text);
-    free(encrypted_text);
-    free(text);
-    free(key);
-    close(connection);
+    if (send_message(connection, text, text_length) < 0)
+        report_error("Error sending on socket");
 }
 
 volatile sig_atomic_t server_active = 1;
 
+// Signal mask the server started with, restored in each worker
+static sigset_t original_mask;
+
 void stop_server(int signal)
 {
     server_active = 0;
 }
 
+void note_worker_exit(int signal)
+{
+    // Only here so SIGCHLD interrupts the parent's sigsuspend
+}
+
+void run_worker(int listen_socket)
+{
+    // Workers are long-lived so their slabs are reused by every request they serve
+    while (server_active)
+    {
+        int connection_fd = accept(listen_socket, NULL, NULL);
+        if (connection_fd < 0)
+        {
+            // These are transient, and exiting would throw away the worker's slabs
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                report_error("Out of file descriptors, retrying accept");
+                usleep(ACCEPT_BACKOFF_USEC);
+                continue;
+            }
+            handle_error(1, "Error accepting connection");
+        }
+
+        // A client that goes quiet is dropped rather than holding the worker forever
+        struct timeval timeout = {CLIENT_TIMEOUT_SEC, 0};
+        setsockopt(connection_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        int binary = authenticate_client(connection_fd);
+        if (binary >= 0)
+            process_encryption(connection_fd, binary);
+        close(connection_fd);
+    }
+}
+
+int spawn_worker(int listen_socket)
+{
+    int pid = fork();
+    if (pid < 0)
+        handle_error(1, "Error forking process");
+    else if (pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        run_worker(listen_socket);
+        exit(0);
+    }
+    return pid;
+}
+
 int main(int argc, char *argv[])
 {
-    signal(SIGINT, stop_server);
+    // No SA_RESTART, so a blocked accept returns and notices the shutdown
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = stop_server;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    struct sigaction child_action;
+    memset(&child_action, 0, sizeof(child_action));
+    child_action.sa_handler = note_worker_exit;
+    sigaction(SIGCHLD, &child_action, NULL);
+
     if (argc < 2)
         handle_error(1, "Usage: %s port_number\n", argv[0]);
 
@@ -142,8 +319,7 @@ int main(int argc, char *argv[])
     if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(option_value)) < 0)
         handle_error(1, "Error setting socket options");
 
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_size = sizeof(client_addr);
+    struct sockaddr_in server_addr;
     init_sockaddr(&server_addr, atoi(argv[1]));
 
     if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
@@ -151,26 +327,41 @@ int main(int argc, char *argv[])
 
     listen(listen_socket, 5);
 
-	while (server_active)
-	{
-		int connection_fd = accept(listen_socket, (struct sockaddr *)&client_addr, &client_addr_size);
-		if (connection_fd < 0)
-			handle_error(1, "Error accepting connection");
-
-		int pid = fork();
-		if (pid < 0)
-			handle_error(1, "Error forking process");
-		else if (pid == 0)
-		{
-			authenticate_client(connection_fd);
-			process_encryption(connection_fd);  // Corrected function name here
-			exit(0);
-		}
-		else
-			close(connection_fd);
-	}
+    // The parent only wakes for these inside sigsuspend, so a stop signal
+    // can never slip in between checking server_active and going to sleep
+    sigset_t parent_signals, wait_mask;
+    sigemptyset(&parent_signals);
+    sigaddset(&parent_signals, SIGINT);
+    sigaddset(&parent_signals, SIGTERM);
+    sigaddset(&parent_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &parent_signals, &original_mask);
+    wait_mask = original_mask;
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    sigdelset(&wait_mask, SIGCHLD);
+
+    // Pre-fork a pool of workers that all accept on the shared listening socket
+    int workers[WORKER_COUNT];
+    for (int i = 0; i < WORKER_COUNT; ++i)
+        workers[i] = spawn_worker(listen_socket);
 
+    // Replace any worker that dies so five encryptions can always run at once
+    while (server_active)
+    {
+        int pid;
+        while (server_active && (pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            for (int i = 0; i < WORKER_COUNT; ++i)
+                if (workers[i] == pid)
+                    workers[i] = spawn_worker(listen_socket);
+        if (server_active)
+            sigsuspend(&wait_mask);
+    }
+
+    for (int i = 0; i < WORKER_COUNT; ++i)
+        kill(workers[i], SIGTERM);
+    while (wait(NULL) > 0)
+        ;
 
     close(listen_socket);
     return 0;
-}
\ No newline at end of file
+}
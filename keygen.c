@@ -1,24 +1,432 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define RING_MAGIC "OTPRING1"
+#define RING_DATA_OFFSET 4096 // Header gets its own page so it can be synced alone
+#define FILL_THREADS 2
+#define FILL_CHUNK 65536
+#define LOW_WATER_PERCENT 50
+#define CLIENT_TIMEOUT_SEC 2 // How long one client may hold up the service
+
+// Bytes 0..242 map evenly onto the 27 symbols; larger bytes are skipped
+#define SYMBOL_LIMIT 243
+static const char symbols[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+// Lives at the start of the pool file. head and tail only ever increase, and
+// (tail - head) bytes of material starting at head % capacity are ready to
+// hand out. Everything before head has been issued, zeroed, and is never
+// issued again. Material is synced to disk before tail moves past it.
+struct ring_header {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+};
+
+struct pad_ring {
+    struct ring_header *header;
+    unsigned char *data;
+    uint64_t low_water;
+    uint64_t reserved; // End of the space fillers have claimed; tail catches up to it
+    int refilling; // Set below the low-water mark, cleared once the ring is full
+    pthread_mutex_t lock;
+    pthread_cond_t needs_fill;
+    pthread_cond_t has_material;
+};
+
+volatile sig_atomic_t service_active = 1;
 
 void error(const char *msg) {
     perror(msg);
     exit(1);
 }
 
+void stop_service(int signal) {
+    service_active = 0;
+}
+
+void fill_random(unsigned char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = getrandom(buffer, length, 0);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            error("getrandom");
+        }
+        buffer += bytes;
+        length -= bytes;
+    }
+}
+
+void open_ring(struct pad_ring *ring, const char *path, uint64_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        error("Error opening pool file");
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+        error("Error reading pool file");
+
+    // A fresh file is sized here; an existing one keeps its own capacity and
+    // positions, so nothing issued before a restart is handed out again
+    int fresh = info.st_size == 0;
+    if (fresh && ftruncate(fd, RING_DATA_OFFSET + capacity) < 0)
+        error("Error sizing pool file");
+    size_t map_size = fresh ? RING_DATA_OFFSET + capacity : (size_t)info.st_size;
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        error("Error mapping pool file");
+    close(fd);
+
+    ring->header = map;
+    ring->data = (unsigned char *)map + RING_DATA_OFFSET;
+    if (fresh) {
+        memcpy(ring->header->magic, RING_MAGIC, sizeof(ring->header->magic));
+        ring->header->capacity = capacity;
+        ring->header->head = 0;
+        ring->header->tail = 0;
+    } else if (memcmp(ring->header->magic, RING_MAGIC, sizeof(ring->header->magic)) != 0 ||
+               RING_DATA_OFFSET + ring->header->capacity != map_size) {
+        fprintf(stderr, "%s is not a pad pool file\n", path);
+        exit(1);
+    }
+
+    ring->reserved = ring->header->tail;
+    ring->low_water = ring->header->capacity * LOW_WATER_PERCENT / 100;
+    ring->refilling = 1;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->needs_fill, NULL);
+    pthread_cond_init(&ring->has_material, NULL);
+}
+
+// Applies msync to [start, start + length) of the ring, split where it wraps
+int sync_ring(struct pad_ring *ring, uint64_t start, uint64_t length, int flags) {
+    uint64_t capacity = ring->header->capacity;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    while (length > 0) {
+        uint64_t offset = start % capacity;
+        uint64_t run = capacity - offset < length ? capacity - offset : length;
+        // msync wants a page-aligned address, so round the run's start down
+        uintptr_t begin = (uintptr_t)(ring->data + offset) & ~(page - 1);
+        if (msync((void *)begin, (uintptr_t)(ring->data + offset + run) - begin, flags) < 0)
+            return -1;
+        start += run;
+        length -= run;
+    }
+    return 0;
+}
+
+void *fill_ring(void *arg) {
+    struct pad_ring *ring = arg;
+    struct ring_header *header = ring->header;
+    unsigned char chunk[FILL_CHUNK];
+
+    for (;;) {
+        pthread_mutex_lock(&ring->lock);
+        while (!ring->refilling)
+            pthread_cond_wait(&ring->needs_fill, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+
+        // The expensive part happens outside the lock so fillers run in parallel
+        fill_random(chunk, sizeof(chunk));
+
+        // Claim free space past everything other fillers are already writing
+        pthread_mutex_lock(&ring->lock);
+        uint64_t space = header->capacity - (ring->reserved - header->head);
+        uint64_t length = space < sizeof(chunk) ? space : sizeof(chunk);
+        uint64_t start = ring->reserved;
+        ring->reserved += length;
+        if (length == 0)
+            ring->refilling = 0;
+        pthread_mutex_unlock(&ring->lock);
+        if (length == 0)
+            continue;
+
+        // Nobody reads or writes the claimed space until tail covers it
+        for (uint64_t copied = 0; copied < length;) {
+            uint64_t offset = (start + copied) % header->capacity;
+            uint64_t run = header->capacity - offset < length - copied ? header->capacity - offset : length - copied;
+            memcpy(ring->data + offset, chunk + copied, run);
+            copied += run;
+        }
+        // Until the material is on disk, a crash could leave tail covering zeros
+        // or stale, already issued bytes
+        if (sync_ring(ring, start, length, MS_SYNC) < 0)
+            error("Error syncing pool file");
+
+        // Publish in order, so tail never skips over a claim still being synced
+        pthread_mutex_lock(&ring->lock);
+        while (header->tail != start)
+            pthread_cond_wait(&ring->has_material, &ring->lock);
+        header->tail += length;
+        if (header->tail - header->head == header->capacity)
+            ring->refilling = 0;
+        pthread_cond_broadcast(&ring->has_material);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return NULL;
+}
+
+// Takes the next keylength symbols (or raw bytes, in binary mode) off the ring
+// into key, waiting for the fillers only if the pool has run dry. Returns -1 if
+// the ring could not be made durable, in which case the key must not be used.
+int issue_key(struct pad_ring *ring, char *key, int keylength, int binary) {
+    struct ring_header *header = ring->header;
+    int issued = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    uint64_t first = header->head;
+    while (issued < keylength) {
+        while (header->tail == header->head) {
+            ring->refilling = 1;
+            pthread_cond_broadcast(&ring->needs_fill);
+            pthread_cond_wait(&ring->has_material, &ring->lock);
+        }
+        // Material is copied out a contiguous run at a time and wiped behind us,
+        // so an issued key only exists with the client
+        uint64_t offset = header->head % header->capacity;
+        uint64_t run = header->tail - header->head;
+        if (run > header->capacity - offset)
+            run = header->capacity - offset;
+        if (binary) {
+            if (run > (uint64_t)(keylength - issued))
+                run = keylength - issued;
+            memcpy(key + issued, ring->data + offset, run);
+            issued += run;
+        } else {
+            uint64_t used = 0;
+            while (issued < keylength && used < run) {
+                unsigned char byte = ring->data[offset + used++];
+                if (byte < SYMBOL_LIMIT)
+                    key[issued++] = symbols[byte % 27];
+            }
+            run = used;
+        }
+        memset(ring->data + offset, 0, run);
+        header->head += run;
+    }
+
+    if (!ring->refilling && header->tail - header->head < ring->low_water) {
+        ring->refilling = 1;
+        pthread_cond_broadcast(&ring->needs_fill);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    // The wiped range and the new head must be on disk before the key leaves,
+    // or a crash could leave the key recoverable or reissue it
+    if (sync_ring(ring, first, header->head - first, MS_SYNC) < 0 ||
+        msync(header, RING_DATA_OFFSET, MS_SYNC) < 0) {
+        perror("Error syncing pool file");
+        return -1;
+    }
+    return 0;
+}
+
+int send_all(int fd, const void *buffer, size_t length) {
+    const char *cursor = buffer;
+    while (length > 0) {
+        ssize_t sent = send(fd, cursor, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        cursor += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+int open_service_socket(const char *socket_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr->sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        error("Error opening socket");
+    return fd;
+}
+
+void serve_keys(const char *pool_path, uint64_t capacity, const char *socket_path) {
+    static struct pad_ring ring;
+    open_ring(&ring, pool_path, capacity);
+
+    struct sockaddr_un addr;
+    int listen_socket = open_service_socket(socket_path, &addr);
+    // Only clear away a stale socket, never a file the path was mistyped onto
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path);
+            exit(1);
+        }
+        unlink(socket_path);
+    }
+
+    // Only the owner may draw keys from the pool, so the socket is created
+    // owner-only rather than loosened by the umask and tightened afterwards
+    mode_t previous_umask = umask(077);
+    int bound = bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr));
+    umask(previous_umask);
+    if (bound < 0)
+        error("Error binding socket");
+    listen(listen_socket, 5);
+
+    // Fillers never see the stop signals, so only accept below is interrupted
+    sigset_t stop_signals, previous;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+    for (int i = 0; i < FILL_THREADS; ++i) {
+        pthread_t filler;
+        if (pthread_create(&filler, NULL, fill_ring, &ring) != 0)
+            error("Error starting filler thread");
+        pthread_detach(filler);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    while (service_active) {
+        int connection = accept(listen_socket, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Error accepting connection");
+        }
+
+        // A client that stalls mid-request is dropped rather than blocking everyone
+        struct timeval timeout = {CLIENT_TIMEOUT_SEC, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Requests are served one at a time, so every key is a contiguous range
+        // A request is the key length followed by whether the key should be binary
+        int request[2];
+        if (recv(connection, request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+            int keylength = request[0];
+            char *key = NULL;
+            if (keylength > 0 && (uint64_t)keylength <= ring.header->capacity)
+                key = malloc(keylength);
+            if (key && issue_key(&ring, key, keylength, request[1]) == 0) {
+                if (send_all(connection, &keylength, sizeof(keylength)) == 0)
+                    send_all(connection, key, keylength);
+            } else {
+                int refusal = -1;
+                send_all(connection, &refusal, sizeof(refusal));
+            }
+            free(key);
+        }
+        close(connection);
+    }
+
+    close(listen_socket);
+    unlink(socket_path);
+    msync(ring.header, RING_DATA_OFFSET, MS_SYNC);
+}
+
+void fetch_key(const char *socket_path, int keylength, int binary) {
+    struct sockaddr_un addr;
+    int fd = open_service_socket(socket_path, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("Error connecting to key service");
+
+    int length, request[2] = {keylength, binary};
+    if (send_all(fd, request, sizeof(request)) < 0 ||
+        recv(fd, &length, sizeof(length), MSG_WAITALL) != sizeof(length))
+        error("Error talking to key service");
+    if (length != keylength) {
+        fprintf(stderr, "Key service refused a key of length %d\n", keylength);
+        exit(1);
+    }
+
+    char buffer[FILL_CHUNK];
+    while (length > 0) {
+        ssize_t bytes = recv(fd, buffer, length < (int)sizeof(buffer) ? length : (int)sizeof(buffer), 0);
+        if (bytes <= 0)
+            error("Error reading from key service");
+        fwrite(buffer, 1, bytes, stdout);
+        length -= bytes;
+    }
+    if (!binary)
+        printf("\n");
+    close(fd);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <keylength>\n", argv[0]);
+    // Service mode: keep a pool of pad material ready and hand it out on request
+    if (argc == 5 && strcmp(argv[1], "-s") == 0) {
+        long long capacity = atoll(argv[3]);
+        if (capacity <= 0) {
+            fprintf(stderr, "Pool size must be a positive integer\n");
+            exit(1);
+        }
+
+        // No SA_RESTART, so a blocked accept returns and notices the shutdown
+        struct sigaction stop_action;
+        memset(&stop_action, 0, sizeof(stop_action));
+        stop_action.sa_handler = stop_service;
+        sigaction(SIGINT, &stop_action, NULL);
+        sigaction(SIGTERM, &stop_action, NULL);
+
+        serve_keys(argv[2], capacity, argv[4]);
+        return 0;
+    }
+
+    // An optional leading -b asks for raw random bytes with no trailing newline
+    int binary = argc > 1 && strcmp(argv[1], "-b") == 0;
+    if (binary) {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc != 2 && !(argc == 4 && strcmp(argv[1], "-f") == 0)) {
+        fprintf(stderr, "Usage: %s [-b] <keylength>\n", argv[0]);
+        fprintf(stderr, "       %s -s <pool file> <pool bytes> <socket path>\n", argv[0]);
+        fprintf(stderr, "       %s [-b] -f <socket path> <keylength>\n", argv[0]);
         exit(1);
     }
 
-    int keylength = atoi(argv[1]);
+    int keylength = atoi(argv[argc - 1]);
     if (keylength <= 0) {
         fprintf(stderr, "Key length must be a positive integer\n");
         exit(1);
     }
 
+    // Fetch mode: take a key from a running service instead of generating one
+    if (argc == 4) {
+        fetch_key(argv[2], keylength, binary);
+        return 0;
+    }
+
+    if (binary) {
+        unsigned char buffer[FILL_CHUNK];
+        for (int remaining = keylength; remaining > 0;) {
+            int length = remaining < (int)sizeof(buffer) ? remaining : (int)sizeof(buffer);
+            fill_random(buffer, length);
+            fwrite(buffer, 1, length, stdout);
+            remaining -= length;
+        }
+        return 0;
+    }
+
     srand(time(NULL));
 
     for (int i = 0; i < keylength; ++i) {